@@ -0,0 +1,119 @@
+"""Content-Length framing for JSON-RPC over byte streams.
+
+Used by ollama_client.py for the MCP gateway's stdio, and meant to be reused
+for organizer-to-agent RPC over any pipe or socket. Everything is bytes:
+Content-Length counts bytes on the wire, so nothing is decoded to text until
+the JSON parser sees the body.
+"""
+
+HEADER_END = b"\r\n\r\n"
+MAX_HEADER = 8 * 1024
+READ_CHUNK = 64 * 1024
+
+
+def parse_content_length(header_block):
+    """Return the Content-Length from a header block, or None if there is none.
+
+    Raises ValueError for a negative length, which no valid peer sends.
+    """
+    for line in bytes(header_block).split(b"\r\n"):
+        name, _, value = line.partition(b":")
+        if name.strip().lower() == b"content-length":
+            try:
+                length = int(value.strip())
+            except ValueError:
+                return None
+            if length < 0:
+                # would move the read position back into the header
+                raise ValueError("negative Content-Length %d" % length)
+            return length
+    return None
+
+
+def write_frame(stream, payload):
+    """Write one framed message; header and payload go out without being joined."""
+    stream.write(b"Content-Length: %d\r\n\r\n" % len(payload))
+    stream.write(payload)
+    stream.flush()
+
+
+class FrameReader:
+    """Read Content-Length frames from a binary stream.
+
+    Incoming bytes land in one reusable buffer via readinto, and are compacted
+    only when a partial frame has to be moved to the front. A body that does
+    not fit in the buffer is read straight into its own bytearray of exactly
+    Content-Length bytes, so a large tool result is copied once from the pipe
+    and then handed to json.loads as-is.
+    """
+
+    def __init__(self, stream, buffer_size=READ_CHUNK):
+        self._stream = stream
+        self._readinto = getattr(stream, "readinto1", stream.readinto)
+        self._buf = bytearray(buffer_size)
+        self._view = memoryview(self._buf)
+        self._start = 0
+        self._end = 0
+
+    def _fill(self):
+        """Read whatever is available into the free tail; False on EOF."""
+        if self._start == self._end:
+            self._start = self._end = 0
+        elif self._end == len(self._buf):
+            # move the unread part to the front to make room
+            pending = self._end - self._start
+            self._buf[:pending] = self._buf[self._start:self._end]
+            self._start, self._end = 0, pending
+        n = self._readinto(self._view[self._end:])
+        if not n:
+            return False
+        self._end += n
+        return True
+
+    def read_frame(self):
+        """Return the next frame body (bytes-like), or None at end of stream.
+
+        Raises ValueError if the peer sends a header block larger than MAX_HEADER
+        or a negative Content-Length.
+        """
+        while True:
+            sep = self._buf.find(HEADER_END, self._start, self._end)
+            if sep < 0:
+                if self._end - self._start > MAX_HEADER:
+                    raise ValueError("frame header exceeds %d bytes" % MAX_HEADER)
+                if not self._fill():
+                    return None
+                continue
+            length = parse_content_length(self._view[self._start:sep])
+            body_start = sep + len(HEADER_END)
+            self._start = body_start
+            if length is None:
+                # not a frame header we understand; skip past it
+                continue
+            return self._read_body(length)
+
+    def _read_body(self, length):
+        available = self._end - self._start
+        if length <= available:
+            body = self._buf[self._start:self._start + length]
+            self._start += length
+            return body
+        if length > len(self._buf) // 2:
+            # too big to stage: read the rest straight into the body's own buffer
+            body = bytearray(length)
+            body[:available] = self._view[self._start:self._end]
+            self._start = self._end = 0
+            view = memoryview(body)
+            got = available
+            while got < length:
+                n = self._stream.readinto(view[got:])
+                if not n:
+                    raise EOFError("stream closed inside a %d byte frame" % length)
+                got += n
+            return body
+        while self._end - self._start < length:
+            if not self._fill():
+                raise EOFError("stream closed inside a %d byte frame" % length)
+        body = self._buf[self._start:self._start + length]
+        self._start += length
+        return body
@@ -0,0 +1,167 @@
+"""Low-overhead spans, counters and latency histograms for the agent loop.
+
+Recording only touches thread-local state, so the hot paths (gateway calls,
+LLM calls) never wait on a lock; exporting merges every thread's data. Output
+needs no extra dependencies:
+  * prometheus_text()  - Prometheus text exposition format
+  * write_trace(path)  - Chrome trace-event JSON; open in https://ui.perfetto.dev
+                         or chrome://tracing for a flame-style view
+  * timeline(since)    - a plain-text timeline for the end of a scan
+"""
+import itertools
+import json
+import os
+import re
+import threading
+import time
+from bisect import bisect_left
+from collections import deque
+from contextlib import contextmanager
+
+# log2-spaced latency buckets in milliseconds: 1 ms .. ~65 s, then +Inf
+BUCKETS_MS = [float(2 ** i) for i in range(17)]
+MAX_SPANS_PER_THREAD = 10000  # oldest spans are evicted past this
+
+_local = threading.local()
+_threads = []  # (thread, state) for every thread that has recorded something
+_registry_lock = threading.Lock()  # taken once per thread, on its first record
+# thread idents are reused, so trace rows get their own never-reused id
+_row_ids = itertools.count(1)
+# data of threads that have exited, folded in by _merged(); spans carry their row id
+_retired = {"counters": {}, "hists": {}, "spans": deque(maxlen=MAX_SPANS_PER_THREAD)}
+
+
+def _state():
+    st = getattr(_local, "state", None)
+    if st is None:
+        st = {
+            "counters": {},
+            "hists": {},
+            "spans": deque(maxlen=MAX_SPANS_PER_THREAD),
+        }
+        _local.state = st
+        with _registry_lock:
+            st["tid"] = next(_row_ids)
+            _threads.append((threading.current_thread(), st))
+    return st
+
+
+def now():
+    """Monotonic timestamp in ns; pass it to timeline()/write_trace() to scope a scan."""
+    return time.perf_counter_ns()
+
+
+def incr(name, n=1):
+    counters = _state()["counters"]
+    counters[name] = counters.get(name, 0) + n
+
+
+def observe(name, ms):
+    hists = _state()["hists"]
+    h = hists.get(name)
+    if h is None:
+        h = hists[name] = [[0] * (len(BUCKETS_MS) + 1), 0.0]
+    h[0][bisect_left(BUCKETS_MS, ms)] += 1
+    h[1] += ms
+
+
+@contextmanager
+def span(name, hist=None):
+    """Time a block as a named span; also feed its duration to `hist` if given."""
+    start = time.perf_counter_ns()
+    try:
+        yield
+    finally:
+        dur = time.perf_counter_ns() - start
+        _state()["spans"].append((name, start, dur))
+        if hist:
+            observe(hist, dur / 1e6)
+
+
+def _add(counters, hists, st):
+    for k, v in dict(st["counters"]).items():
+        counters[k] = counters.get(k, 0) + v
+    for k, (buckets, total) in dict(st["hists"]).items():
+        acc = hists.setdefault(k, [[0] * len(buckets), 0.0])
+        acc[0] = [a + b for a, b in zip(acc[0], buckets)]
+        acc[1] += total
+
+
+def _merged():
+    with _registry_lock:
+        # fold exited threads (e.g. one-shot gateway respawns) into _retired so
+        # their states, and their full span buffers, do not pile up
+        for thread, st in [entry for entry in _threads if not entry[0].is_alive()]:
+            _threads.remove((thread, st))
+            _add(_retired["counters"], _retired["hists"], st)
+            _retired["spans"].extend((st["tid"],) + s for s in st["spans"])
+        live = [st for _, st in _threads]
+        counters = dict(_retired["counters"])
+        hists = {k: [list(b), total] for k, (b, total) in _retired["hists"].items()}
+        spans = list(_retired["spans"])
+    for st in live:
+        _add(counters, hists, st)
+        spans.extend((st["tid"],) + s for s in st["spans"].copy())
+    return counters, hists, spans
+
+
+def _metric_name(name):
+    return "deepfence_" + re.sub(r"[^a-zA-Z0-9_]", "_", name)
+
+
+def prometheus_text():
+    counters, hists, _ = _merged()
+    lines = []
+    for k in sorted(counters):
+        m = _metric_name(k)
+        lines += [f"# TYPE {m}_total counter", f"{m}_total {counters[k]}"]
+    for k in sorted(hists):
+        m = _metric_name(k)
+        buckets, total = hists[k]
+        lines.append(f"# TYPE {m} histogram")
+        cumulative = 0
+        for le, count in zip(BUCKETS_MS + ["+Inf"], buckets):
+            cumulative += count
+            lines.append(f'{m}_bucket{{le="{le}"}} {cumulative}')
+        lines += [f"{m}_sum {total:.3f}", f"{m}_count {cumulative}"]
+    return "\n".join(lines) + "\n"
+
+
+def write_trace(path, since=0):
+    """Write spans started after `since` as Chrome trace-event JSON."""
+    _, _, spans = _merged()
+    pid = os.getpid()
+    events = [
+        {"name": name, "ph": "X", "ts": start / 1000, "dur": dur / 1000, "pid": pid, "tid": tid}
+        for tid, name, start, dur in spans
+        if start >= since
+    ]
+    with open(path, "w", encoding="utf-8") as f:
+        json.dump({"traceEvents": events, "displayTimeUnit": "ms"}, f)
+
+
+def timeline(since=0, width=40, max_rows=30):
+    """Render spans started after `since` as text bars plus a per-name summary."""
+    _, _, spans = _merged()
+    spans = sorted((s for s in spans if s[2] >= since), key=lambda s: s[2])
+    if not spans:
+        return "📊 No spans recorded."
+    t0 = spans[0][2]
+    total = max(start + dur for _, _, start, dur in spans) - t0 or 1
+    label = max(len(s[1]) for s in spans)
+    rows = [f"📊 Scan timeline ({total / 1e9:.2f}s, {len(spans)} spans)"]
+    for _, name, start, dur in spans[:max_rows]:
+        a = min(width - 1, (start - t0) * width // total)
+        b = max(a + 1, (start - t0 + dur) * width // total)
+        bar = " " * a + "█" * (b - a) + " " * (width - b)
+        rows.append(f"  {name:<{label}} |{bar}| {(start - t0) / 1e9:6.2f}s +{dur / 1e9:.2f}s")
+    if len(spans) > max_rows:
+        rows.append(f"  ... {len(spans) - max_rows} more")
+    by_name = {}
+    for _, name, _, dur in spans:
+        n, t, m = by_name.get(name, (0, 0, 0))
+        by_name[name] = (n + 1, t + dur, max(m, dur))
+    rows.append("  top spans by total time:")
+    for name, (n, t, m) in sorted(by_name.items(), key=lambda kv: -kv[1][1])[:10]:
+        rows.append(f"    {name:<{label}} x{n:<4} total {t / 1e9:.2f}s  max {m / 1e9:.2f}s")
+    return "\n".join(rows)
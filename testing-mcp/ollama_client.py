@@ -1,279 +1,708 @@
 import subprocess
 import json
+import os
+import hashlib
 import ollama
-from jsonrpcclient import parse, request_json
+from jsonrpcclient import parse, request
 import shlex
 import time
 from pathlib import Path
 import threading
-import queue
+from collections import Counter, deque
+from concurrent.futures import Future, ThreadPoolExecutor, TimeoutError as FutureTimeout
+from mcp_framing import FrameReader, write_frame
+import metrics
 
 # -----------------------------
-# 1️⃣ MCP Gateway management (lazy start / restart from config)
+# 1️⃣ MCP Gateway pool (lazy start / supervised restart from config)
 # -----------------------------
-gateway_proc = None
 DEFAULT_GATEWAY_CMD = ["docker", "mcp", "gateway", "run"]
-CONFIG_PATH = Path(__file__).parent / "mcp-ollama.json"
+GATEWAY_SERVER_NAME = "MCP_DOCKER"
+# first match wins: the client's own config, then the workspace's VS Code config
+CONFIG_PATHS = [
+    Path(__file__).parent / "mcp-ollama.json",
+    Path(__file__).parent.parent / ".vscode" / "mcp.json",
+]
+GATEWAY_POOL_SIZE = 2
+PING_TIMEOUT = 10.0
+CALL_TIMEOUT = 30.0
+# delay before retrying a failed spawn, doubled per failure up to the max
+RESPAWN_BACKOFF = 1.0
+RESPAWN_BACKOFF_MAX = 60.0
 
-def load_gateway_cmd_from_config():
-    """Load gateway command from mcp-ollama.json if available, fall back to default."""
-    try:
-        if CONFIG_PATH.exists():
-            data = json.loads(CONFIG_PATH.read_text())
-            # common keys: "gateway_cmd": [..] or "command": "docker mcp gateway run" or "run": [...]
-            if isinstance(data.get("gateway_cmd"), list):
-                return data["gateway_cmd"]
-            if isinstance(data.get("run"), list):
-                return data["run"]
-            if isinstance(data.get("command"), str):
-                return shlex.split(data["command"])
-    except Exception as e:
-        print("⚠️ Failed to read mcp-ollama.json:", e)
-    return DEFAULT_GATEWAY_CMD
-
-def start_gateway(cmd=None):
-    """Start the MCP gateway subprocess and assign to global gateway_proc.
-
-    Try list-form Popen first. If the process immediately exits or emits no output
-    (which can happen with some docker wrapper commands on Windows), try a shell
-    invocation fallback. If both fail, print diagnostics — the script requires
-    a gateway that runs in the foreground and speaks over stdio.
+def load_gateway_config():
+    """Return (cmd, env) for the MCP_DOCKER stdio server.
+
+    testing-mcp/mcp-ollama.json nests the server under `mcp.servers.MCP_DOCKER`;
+    .vscode/mcp.json has it at top-level `servers.MCP_DOCKER`. Either shape is
+    accepted, and the default docker command is used when no config has it.
     """
-    global gateway_proc
-    raw_cmd = cmd or load_gateway_cmd_from_config()
-    # normalize: keep both forms available
-    if isinstance(raw_cmd, list):
-        cmd_list = raw_cmd
-        cmd_str = " ".join(shlex.quote(str(x)) for x in raw_cmd)
-    else:
-        cmd_list = raw_cmd.split() if isinstance(raw_cmd, str) else raw_cmd
-        cmd_str = raw_cmd if isinstance(raw_cmd, str) else " ".join(map(str, cmd_list))
-
-    # ensure previous process gone
-    if gateway_proc is not None and gateway_proc.poll() is None:
+    for path in CONFIG_PATHS:
         try:
-            gateway_proc.kill()
-            gateway_proc.wait(timeout=2)
-        except Exception:
-            pass
+            if not path.exists():
+                continue
+            data = json.loads(path.read_text())
+            servers = data.get("servers") or data.get("mcp", {}).get("servers") or {}
+            server = servers.get(GATEWAY_SERVER_NAME)
+            if not server or not server.get("command"):
+                continue
+            cmd = [server["command"], *server.get("args", [])]
+            env = {**os.environ, **server.get("env", {})}
+            return cmd, env
+        except Exception as e:
+            print(f"⚠️ Failed to read {path.name}:", e)
+    return DEFAULT_GATEWAY_CMD, None
+
+def spawn_gateway(cmd=None, env=None):
+    """Start one MCP gateway subprocess and return its GatewayTransport, or None.
+
+    Readiness is a JSON-RPC `ping` rather than a fixed sleep. If the list-form
+    Popen exits without answering (which can happen with some docker wrapper
+    commands on Windows), try a shell invocation fallback. If both fail, print
+    diagnostics — the gateway must run in the foreground and speak over stdio.
+    """
+    if cmd is None:
+        cmd, env = load_gateway_config()
 
     # Helper to actually spawn
-    def _spawn(use_shell=False, cmd_to_use=None):
+    def _spawn(use_shell=False):
+        cmd_to_use = cmd
+        if use_shell:
+            cmd_to_use = subprocess.list2cmdline(cmd) if os.name == "nt" else shlex.join(cmd)
         try:
-            if use_shell:
-                print(f"🔁 Starting gateway (shell) with: {cmd_to_use}")
-                return subprocess.Popen(
-                    cmd_to_use,
-                    shell=True,
-                    stdin=subprocess.PIPE,
-                    stdout=subprocess.PIPE,
-                    stderr=subprocess.PIPE,
-                    text=True,
-                )
-            else:
-                print(f"🔁 Starting gateway (list) with: {cmd_to_use}")
-                return subprocess.Popen(
-                    cmd_to_use,
-                    stdin=subprocess.PIPE,
-                    stdout=subprocess.PIPE,
-                    stderr=subprocess.PIPE,
-                    text=True,
-                )
+            print(f"🔁 Starting gateway ({'shell' if use_shell else 'list'}) with: {cmd_to_use}")
+            return subprocess.Popen(
+                cmd_to_use,
+                shell=use_shell,
+                stdin=subprocess.PIPE,
+                stdout=subprocess.PIPE,
+                stderr=subprocess.PIPE,
+                env=env,
+            )
         except Exception as e:
             print("⚠️ Failed to spawn gateway process:", e)
             return None
 
-    # Try list-form first (preferred)
-    gateway_proc = _spawn(use_shell=False, cmd_to_use=cmd_list)
-    time.sleep(1.0)
-
-    # Quick health check: process alive and not immediately exited
-    if gateway_proc is None or gateway_proc.poll() is not None:
-        # Try shell fallback
-        print("⚠️ Gateway process exited immediately or failed. Trying shell fallback...")
-        gateway_proc = _spawn(use_shell=True, cmd_to_use=cmd_str)
-        time.sleep(1.0)
-
-    # If still not usable, print guidance
-    if gateway_proc is None or gateway_proc.poll() is not None:
-        print("❗ Unable to start a usable MCP gateway process from the configured command.")
-        print("This script requires the gateway to run in the foreground and communicate over stdio.")
-        print("Please either:")
-        print("  • Ensure 'mcp-ollama.json' contains a command that runs the gateway in the foreground (no -d / --detach),")
-        print("  • or start the gateway manually from a terminal with: docker mcp gateway run")
-        print("After starting the gateway manually the script should be able to send JSON-RPC requests.")
-    else:
-        print("✅ Gateway started (pid=%s)." % gateway_proc.pid)
-
-def _read_gateway_response(timeout=30.0):
-    """Read a Content-Length framed JSON-RPC response from gateway_proc.stdout with timeout.
-    Returns the raw JSON string or None on timeout/error.
+    for use_shell in (False, True):
+        proc = _spawn(use_shell=use_shell)
+        if proc is None:
+            continue
+        transport = GatewayTransport(proc)
+        if transport.ping(PING_TIMEOUT):
+            print("✅ Gateway started (pid=%s)." % proc.pid)
+            return transport
+        transport.close()
+        if not use_shell:
+            print("⚠️ Gateway process exited or did not answer ping. Trying shell fallback...")
+
+    print("❗ Unable to start a usable MCP gateway process from the configured command.")
+    print("This script requires the gateway to run in the foreground and communicate over stdio.")
+    print("Please either:")
+    print(f"  • Ensure servers.{GATEWAY_SERVER_NAME} in 'mcp-ollama.json' runs the gateway in the foreground (no -d / --detach),")
+    print("  • or start the gateway manually from a terminal with: docker mcp gateway run")
+    print("After starting the gateway manually the script should be able to send JSON-RPC requests.")
+    return None
+
+class GatewayTransport:
+    """Multiplexed JSON-RPC transport over one gateway process's stdio.
+
+    A single long-lived reader thread owns proc.stdout, decodes Content-Length
+    frames with mcp_framing.FrameReader and resolves the caller waiting on the
+    matching JSON-RPC id, so many requests can be in flight at once.
     """
-    if gateway_proc is None or gateway_proc.stdout is None:
-        return None
-    q = queue.Queue()
 
-    def _reader():
+    def __init__(self, proc):
+        self.proc = proc
+        self._pending = {}
+        self._lock = threading.Lock()
+        self._write_lock = threading.Lock()
+        self._closed = False
+        # keep the tail of stderr for diagnostics; an undrained pipe would block the gateway
+        self.stderr_tail = deque(maxlen=20)
+        self._reader = threading.Thread(target=self._read_loop, daemon=True)
+        self._reader.start()
+        threading.Thread(target=self._drain_stderr, daemon=True).start()
+
+    @property
+    def alive(self):
+        return not self._closed and self.proc.poll() is None
+
+    @property
+    def load(self):
+        """Number of requests currently waiting on this gateway."""
+        return len(self._pending)
+
+    def ping(self, timeout):
+        """Cheap liveness check: any reply to MCP `ping`, even an error, counts."""
+        req = request("ping")
+        try:
+            self.send(req).result(timeout=timeout)
+            return True
+        except Exception:
+            self.forget(req["id"])
+            return False
+
+    def close(self):
+        """Kill the process; the reader then fails any callers still waiting."""
+        try:
+            self.proc.kill()
+            self.proc.wait(timeout=2)
+        except Exception:
+            pass
+
+    def send(self, req):
+        """Write one request dict; returns a Future resolved with the parsed response."""
+        fut = Future()
+        with self._lock:
+            if self._closed:
+                raise ConnectionError("gateway transport is closed")
+            self._pending[req["id"]] = fut
+        payload = json.dumps(req).encode("utf-8")
+        try:
+            with self._write_lock:
+                write_frame(self.proc.stdin, payload)
+        except Exception:
+            with self._lock:
+                self._pending.pop(req["id"], None)
+            raise
+        return fut
+
+    def forget(self, req_id):
+        """Drop a caller that gave up waiting so a late reply is discarded."""
+        with self._lock:
+            self._pending.pop(req_id, None)
+
+    def _read_loop(self):
+        reader = FrameReader(self.proc.stdout)
         try:
-            # read headers until empty line
-            headers = {}
             while True:
-                line = gateway_proc.stdout.readline()
-                if not line:
-                    # EOF or closed
-                    q.put(None)
-                    return
-                line = line.strip("\r\n")
-                if line == "":
+                body = reader.read_frame()
+                if body is None:
                     break
-                parts = line.split(":", 1)
-                if len(parts) == 2:
-                    headers[parts[0].strip().lower()] = parts[1].strip()
-            # parse content-length
-            length = headers.get("content-length")
-            if length is None:
-                q.put(None)
-                return
-            try:
-                n = int(length)
-            except Exception:
-                q.put(None)
-                return
-            # read exactly n characters
-            body = ""
-            remaining = n
-            while remaining > 0:
-                chunk = gateway_proc.stdout.read(remaining)
-                if chunk == "" or chunk is None:
-                    q.put(None)
-                    return
-                body += chunk
-                remaining = n - len(body)
-            q.put(body)
+                self._dispatch(body)
+        except Exception as e:
+            print("⚠️ Gateway reader stopped:", e)
+        finally:
+            self._close()
+
+    def _drain_stderr(self):
+        try:
+            for line in self.proc.stderr:
+                self.stderr_tail.append(line.decode("utf-8", "replace").rstrip())
         except Exception:
-            q.put(None)
+            pass
 
-    t = threading.Thread(target=_reader, daemon=True)
-    t.start()
-    try:
-        return q.get(timeout=timeout)
-    except queue.Empty:
-        return None
+    def _dispatch(self, body):
+        try:
+            data = json.loads(body)
+        except ValueError:
+            print("🔴 Unparseable gateway frame (debug):", bytes(body[:200]))
+            return
+        is_reply = isinstance(data, dict) and "method" not in data
+        fut = None
+        if is_reply:
+            with self._lock:
+                fut = self._pending.pop(data.get("id"), None)
+        if fut is None:
+            # notifications and server-to-client requests (which may reuse one of
+            # our ids), or replies to callers that already timed out
+            print("🔴 Unsolicited gateway message (debug):", data)
+            return
+        try:
+            fut.set_result(parse(data))
+        except Exception as e:
+            fut.set_exception(e)
+
+    def _close(self):
+        with self._lock:
+            self._closed = True
+            pending, self._pending = self._pending, {}
+        for fut in pending.values():
+            fut.set_exception(ConnectionError("gateway closed stdout"))
+
+class GatewayPool:
+    """A supervised pool of warm gateway processes.
+
+    Calls go to the live worker with the fewest requests in flight. A worker
+    that dies, or stops answering pings after a call times out, is retired and
+    respawned in the background, so one stuck tool never stalls calls routed
+    to the other workers. A spawn that fails is retried with backoff until the
+    pool is back to `size`.
+    """
+
+    def __init__(self, size=GATEWAY_POOL_SIZE):
+        self.size = size
+        self._workers = []
+        self._restarting = 0
+        self._checking = set()
+        self._cond = threading.Condition()
 
-def ensure_gateway_running():
-    """Ensure the gateway subprocess is running; start it if not."""
-    global gateway_proc
-    if gateway_proc is None or gateway_proc.poll() is not None:
-        start_gateway()
+    def start(self):
+        """Warm the pool in the background so the first tool call does not wait."""
+        with self._cond:
+            self._top_up_locked()
+
+    def _top_up_locked(self):
+        for _ in range(self.size - len(self._workers) - self._restarting):
+            self._respawn_async()
+
+    def _respawn_async(self):
+        # caller holds self._cond
+        self._restarting += 1
+        threading.Thread(target=self._respawn, daemon=True).start()
+
+    def _respawn(self):
+        delay = RESPAWN_BACKOFF
+        while True:
+            with metrics.span("gateway spawn", hist="gateway_spawn_ms"):
+                transport = spawn_gateway()
+            with self._cond:
+                if transport is not None:
+                    self._workers.append(transport)
+                if transport is not None or len(self._workers) + self._restarting > self.size:
+                    self._restarting -= 1
+                    self._cond.notify_all()
+                    return
+            metrics.incr("gateway_spawn_failures")
+            print(f"⚠️ Gateway spawn failed. Retrying in {delay:.0f}s...")
+            time.sleep(delay)
+            delay = min(delay * 2, RESPAWN_BACKOFF_MAX)
+
+    def acquire(self, timeout=PING_TIMEOUT * 2 + 5):
+        """Return the least-loaded live gateway, waiting for a restart if needed."""
+        deadline = time.monotonic() + timeout
+        topped_up = False
+        with self._cond:
+            while True:
+                for dead in [w for w in self._workers if not w.alive]:
+                    self._retire_locked(dead)
+                if self._workers:
+                    # stay off workers under a health check unless nothing else is left
+                    healthy = [w for w in self._workers if w not in self._checking]
+                    return min(healthy or self._workers, key=lambda w: w.load)
+                if self._restarting == 0:
+                    # every worker is gone and nothing is coming back: start over once
+                    if topped_up:
+                        return None
+                    self._top_up_locked()
+                    topped_up = True
+                remaining = deadline - time.monotonic()
+                if remaining <= 0:
+                    return None
+                self._cond.wait(remaining)
+
+    def check_async(self, transport):
+        """Ping a worker in the background and retire it if it does not answer."""
+        with self._cond:
+            if transport in self._checking or transport not in self._workers:
+                return
+            self._checking.add(transport)
+        threading.Thread(target=self._check, args=(transport,), daemon=True).start()
+
+    def _check(self, transport):
+        try:
+            healthy = transport.ping(PING_TIMEOUT)
+        finally:
+            with self._cond:
+                self._checking.discard(transport)
+        if not healthy:
+            self.retire(transport)
+
+    def retire(self, transport):
+        """Take a dead or hung worker out of rotation and replace it in the background."""
+        with self._cond:
+            self._retire_locked(transport)
+
+    def _retire_locked(self, transport):
+        if transport not in self._workers:
+            return
+        self._workers.remove(transport)
+        metrics.incr("gateway_retired")
+        print("⚠️ Retiring gateway pid=%s." % transport.proc.pid)
+        for line in transport.stderr_tail:
+            print("🔴 gateway stderr (debug):", line)
+        threading.Thread(target=transport.close, daemon=True).start()
+        self._respawn_async()
+
+gateway_pool = GatewayPool()
 
 # -----------------------------
 # 2️⃣ Chat with Ollama
 # -----------------------------
-def chat_with_ollama(prompt):
-    """Send prompt to Ollama and get response."""
-    response = ollama.chat(
-        model="gpt-oss:120b-cloud",
-        messages=[{"role": "user", "content": prompt}]
+MODEL = "gpt-oss:120b-cloud"
+SYSTEM_PROMPT = (
+    "You are an agent that must respond with JSON tool calls "
+    "when instructed to run tools like Semgrep. "
+    "Format:\n"
+    "{\n"
+    "  \"method\": \"tools.<tool_name>\",\n"
+    "  \"params\": { ... }\n"
+    "}\n"
+    "When several tools can run independently, respond with a JSON array "
+    "of these objects so they are executed together.\n"
+    "Always respond in JSON when a tool needs to be executed."
+)
+# keep the model loaded between calls so the backend can reuse the KV cache
+# of the shared system-prompt prefix instead of re-evaluating it every time
+KEEP_ALIVE = "30m"
+LLM_CACHE_DIR = Path(__file__).parent / ".llm-cache"
+LLM_CACHE_TTL = 7 * 24 * 3600.0
+
+_model_versions = {}
+
+def _model_version(model):
+    """Identify the exact model build so a model update invalidates cached replies.
+
+    Returns None if the build cannot be determined; that is not remembered, so
+    the next call asks again.
+    """
+    if model not in _model_versions:
+        try:
+            info = ollama.show(model)
+        except Exception:
+            return None
+        version = info.get("digest") or info.get("modified_at")
+        if not version:
+            return None
+        _model_versions[model] = str(version)
+    return _model_versions[model]
+
+def _cache_path(model, messages):
+    """Cache file for a request, or None when the model version is unknown."""
+    version = _model_version(model)
+    if version is None:
+        # without a version a cached reply from an older build could be served
+        return None
+    key = json.dumps(
+        {"model": model, "version": version, "messages": messages},
+        sort_keys=True,
     )
-    return response["message"]["content"]
+    return LLM_CACHE_DIR / (hashlib.sha256(key.encode("utf-8")).hexdigest() + ".json")
+
+def _cache_get(path):
+    try:
+        entry = json.loads(path.read_text(encoding="utf-8"))
+    except (OSError, ValueError):
+        return None
+    if time.time() - entry.get("created", 0) > LLM_CACHE_TTL:
+        try:
+            path.unlink()
+        except OSError:
+            pass
+        return None
+    return entry.get("content")
+
+def sweep_llm_cache():
+    """Delete cache entries (and stray temp files) older than LLM_CACHE_TTL."""
+    cutoff = time.time() - LLM_CACHE_TTL
+    removed = 0
+    try:
+        entries = list(LLM_CACHE_DIR.iterdir())
+    except OSError:
+        return
+    for entry in entries:
+        try:
+            # entries are written once and renamed into place, so mtime is their age
+            if entry.stat().st_mtime < cutoff:
+                entry.unlink()
+                removed += 1
+        except OSError:
+            pass
+    if removed:
+        print(f"🧹 Removed {removed} expired LLM cache entries.")
+
+def _cache_put(path, content):
+    try:
+        LLM_CACHE_DIR.mkdir(exist_ok=True)
+        tmp = path.with_suffix(".tmp.%d" % threading.get_ident())
+        tmp.write_text(json.dumps({"created": time.time(), "content": content}), encoding="utf-8")
+        os.replace(tmp, path)
+    except OSError as e:
+        print("⚠️ Failed to write LLM cache entry:", e)
+
+def chat_with_ollama(prompt, use_cache=True, on_text=None):
+    """Send prompt to Ollama and get response.
+
+    The system prompt always goes first as its own message so every call shares
+    the same prefix. Replies are cached on disk by a hash of (model, model
+    version, messages) for LLM_CACHE_TTL; a repeated prompt, including one that
+    embeds the same tool results, is answered without calling the model. The
+    cache is bypassed while the model version cannot be read.
+
+    With on_text the reply is streamed and on_text is called with each piece of
+    text as it arrives (once with the whole reply on a cache hit).
+    """
+    messages = [
+        {"role": "system", "content": SYSTEM_PROMPT},
+        {"role": "user", "content": prompt},
+    ]
+    path = _cache_path(MODEL, messages) if use_cache else None
+    if path is not None:
+        cached = _cache_get(path)
+        if cached is not None:
+            metrics.incr("llm_cache_hits")
+            print("♻️ Using cached Ollama reply.")
+            if on_text is not None:
+                on_text(cached)
+            return cached
+    metrics.incr("llm_calls")
+    with metrics.span("llm chat", hist="llm_latency_ms"):
+        if on_text is None:
+            response = ollama.chat(
+                model=MODEL,
+                messages=messages,
+                keep_alive=KEEP_ALIVE,
+            )
+            content = response["message"]["content"]
+        else:
+            parts = []
+            response = {}
+            for response in ollama.chat(
+                model=MODEL,
+                messages=messages,
+                keep_alive=KEEP_ALIVE,
+                stream=True,
+            ):
+                text = response["message"]["content"]
+                if text:
+                    parts.append(text)
+                    on_text(text)
+            content = "".join(parts)
+    # token counts arrive on the final (done) response
+    metrics.incr("llm_prompt_tokens", response.get("prompt_eval_count") or 0)
+    metrics.incr("llm_completion_tokens", response.get("eval_count") or 0)
+    if path is not None:
+        _cache_put(path, content)
+    return content
 
 # -----------------------------
 # 3️⃣ Handle Ollama messages
 # -----------------------------
-def handle_agent_message(message):
-    """Detect JSON tool calls and execute them."""
-    try:
-        data = json.loads(message)
-        if "method" in data and data["method"].startswith("tools."):
-            print(f"🧰 Tool call detected: {data['method']}")
-            result = call_mcp(data["method"], data.get("params", {}))
-            print("🔧 Tool result:", result)
-
-            # Feed results back to Ollama for further reasoning
-            followup = chat_with_ollama(
-                f"Tool '{data['method']}' executed with result:\n{result}\n\n"
-                "Continue reasoning or provide next instructions."
-            )
-            # Recursively handle next tool calls
-            handle_agent_message(followup)
+MAX_TOOL_TURNS = 10
+MAX_PARALLEL_TOOLS = 16
+tool_executor = ThreadPoolExecutor(max_workers=MAX_PARALLEL_TOOLS)
+
+class ToolCallScanner:
+    """Incrementally pick complete tool-call objects out of streamed model text.
+
+    Tracks brace depth outside of JSON strings, so a top-level `{...}` is
+    recognised the moment its closing brace arrives, whether the reply is a
+    single object, a JSON array of them, or JSON wrapped in prose. Prose with
+    an unbalanced brace or quote can throw the depth count off for the rest
+    of the stream; scan() re-reads the whole reply for that case.
+    """
+
+    def __init__(self):
+        self._buf = []
+        self._depth = 0
+        self._in_string = False
+        self._escape = False
+
+    def feed(self, text):
+        """Consume the next piece of text; returns the tool calls it completed."""
+        calls = []
+        i, n = 0, len(text)
+        while i < n:
+            if self._depth == 0:
+                # between objects: jump straight to the next opening brace
+                i = text.find("{", i)
+                if i < 0:
+                    break
+            ch = text[i]
+            self._buf.append(ch)
+            i += 1
+            if self._in_string:
+                if self._escape:
+                    self._escape = False
+                elif ch == "\\":
+                    self._escape = True
+                elif ch == '"':
+                    self._in_string = False
+            elif ch == '"':
+                self._in_string = True
+            elif ch == "{":
+                self._depth += 1
+            elif ch == "}":
+                self._depth -= 1
+                if self._depth == 0:
+                    call = self._as_tool_call("".join(self._buf))
+                    self._buf = []
+                    if call is not None:
+                        calls.append(call)
+        return calls
+
+    @staticmethod
+    def scan(text):
+        """Find tool calls in a complete reply by trying to decode at every `{`."""
+        decoder = json.JSONDecoder()
+        calls = []
+        i = text.find("{")
+        while i >= 0:
+            try:
+                data, end = decoder.raw_decode(text, i)
+            except json.JSONDecodeError:
+                i = text.find("{", i + 1)
+                continue
+            if isinstance(data, dict) and str(data.get("method", "")).startswith("tools."):
+                calls.append(data)
+            i = text.find("{", end)
+        return calls
+
+    @staticmethod
+    def _as_tool_call(text):
+        try:
+            data = json.loads(text)
+        except json.JSONDecodeError:
+            return None
+        if isinstance(data, dict) and str(data.get("method", "")).startswith("tools."):
+            return data
+        return None
+
+def agent_turn(prompt):
+    """Stream one model reply, starting each tool call as soon as it is complete.
+
+    Returns the full reply and a list of (call, Future) for the dispatched
+    tools, so gateway work overlaps with the rest of the generation.
+    """
+    scanner = ToolCallScanner()
+    dispatched = []
+
+    def dispatch(calls):
+        for call in calls:
+            print(f"🧰 Tool call detected: {call['method']}")
+            fut = tool_executor.submit(call_mcp, call["method"], call.get("params", {}))
+            dispatched.append((call, fut))
+
+    reply = chat_with_ollama(prompt, on_text=lambda text: dispatch(scanner.feed(text)))
+    # stray prose may have thrown the streaming scanner off; re-read the whole
+    # reply and start whatever it missed, without repeating what already ran
+    started = Counter(json.dumps(call, sort_keys=True) for call, _ in dispatched)
+    missed = []
+    for call in ToolCallScanner.scan(reply):
+        key = json.dumps(call, sort_keys=True)
+        if started[key]:
+            started[key] -= 1
         else:
-            # Plain text response
-            print("🤖 Ollama:", message)
-    except json.JSONDecodeError:
-        # Non-JSON text is treated as a normal response
-        print("🤖 Ollama:", message)
+            missed.append(call)
+    dispatch(missed)
+    return reply, dispatched
+
+def handle_agent_message(prompt):
+    """Run the agent on a prompt until the model answers in plain text.
+
+    Tool calls run concurrently while the reply is still streaming, and all
+    their results go back to the model in a single follow-up turn. Turns are
+    bounded by MAX_TOOL_TURNS.
+    """
+    for _ in range(MAX_TOOL_TURNS):
+        metrics.incr("agent_turns")
+        with metrics.span("agent turn"):
+            reply, dispatched = agent_turn(prompt)
+        if not dispatched:
+            # Non-JSON text is treated as a normal response
+            print("🤖 Ollama:", reply)
+            return
+        report = []
+        for call, fut in dispatched:
+            try:
+                result = fut.result()
+            except Exception as e:
+                # one failed tool must not end the session; let the model see it
+                metrics.incr("tool_errors")
+                result = f"error: {e!r}"
+            print(f"🔧 Tool result ({call['method']}):", result)
+            report.append(f"Tool '{call['method']}' executed with result:\n{result}")
+
+        # Feed all results back to Ollama for further reasoning in one turn
+        prompt = (
+            "\n\n".join(report) + "\n\n"
+            "Continue reasoning or provide next instructions."
+        )
+    print(f"⚠️ Stopping after {MAX_TOOL_TURNS} tool turns. Last prompt:", prompt)
 
 # -----------------------------
 # 4️⃣ Main agent loop
 # -----------------------------
+METRICS_DIR = Path(__file__).parent / ".metrics"
+
+def report_metrics(since):
+    """Print the scan's timeline and refresh the Prometheus and trace exports."""
+    print(metrics.timeline(since))
+    try:
+        METRICS_DIR.mkdir(exist_ok=True)
+        (METRICS_DIR / "metrics.prom").write_text(metrics.prometheus_text(), encoding="utf-8")
+        metrics.write_trace(METRICS_DIR / "trace.json", since)
+        print(f"📈 Metrics written to {METRICS_DIR} (metrics.prom, trace.json)")
+    except OSError as e:
+        print("⚠️ Failed to write metrics:", e)
+
 def main():
     print("🚀 MCP-Ollama Agent started. Type a prompt.")
-    system_prompt = (
-        "You are an agent that must respond with JSON tool calls "
-        "when instructed to run tools like Semgrep. "
-        "Format:\n"
-        "{\n"
-        "  \"method\": \"tools.<tool_name>\",\n"
-        "  \"params\": { ... }\n"
-        "}\n"
-        "Always respond in JSON when a tool needs to be executed."
-    )
+    gateway_pool.start()
+    threading.Thread(target=sweep_llm_cache, daemon=True).start()
 
     while True:
         user_input = input("\n🗣️  You: ")
-        full_prompt = f"{system_prompt}\nUser request:\n{user_input}"
-        reply = chat_with_ollama(full_prompt)
-        handle_agent_message(reply)
+        scan_start = metrics.now()
+        handle_agent_message(f"User request:\n{user_input}")
+        report_metrics(scan_start)
 
 def call_mcp(method, params):
-    """Send a JSON-RPC request to the MCP gateway via stdio using Content-Length framing."""
-    params = params or {}
-    payload = request_json(method, params=params)  # JSON string
-    # Compose Content-Length framed message (no extra newline after payload)
-    payload_bytes = payload.encode("utf-8")
-    header = f"Content-Length: {len(payload_bytes)}\r\n\r\n"
-    message = header + payload
-
-    # Try twice: initial attempt, then restart gateway from config and retry if no response
-    for attempt in range(2):
-        ensure_gateway_running()
+    """Send a JSON-RPC request to the MCP gateway and wait for the reply with its id.
+
+    Safe to call from several threads at once. A request that cannot be
+    written to the chosen gateway is retried once on another worker. Once it
+    has gone out it is never resent: if the gateway dies before answering (maybe
+    because of this call) the worker is retired and the call given up, and a
+    call that only exceeds CALL_TIMEOUT is given up at once while its worker
+    is pinged in the background and retired only if that fails too.
+    """
+    req = request(method, params=params or {})
+    metrics.incr("mcp_calls")
+    with metrics.span(f"mcp {method}", hist="gateway_latency_ms"):
+        return _call_mcp(req)
+
+def _call_mcp(req):
+    for _ in range(2):
+        with metrics.span("gateway acquire"):
+            transport = gateway_pool.acquire()
+        if transport is None:
+            print("❗ No usable MCP gateway available. Proceeding without tool result.")
+            return None
         try:
-            gateway_proc.stdin.write(message)
-            gateway_proc.stdin.flush()
+            fut = transport.send(req)
         except Exception as e:
-            print("⚠️ Failed to send request to MCP gateway (will try restart):", e)
-            try:
-                gateway_proc.kill()
-            except Exception:
-                pass
-            start_gateway(load_gateway_cmd_from_config())
+            # the request never went out, so another worker can safely take it
+            print("⚠️ Failed to send request to MCP gateway (routing to another worker):", e)
+            gateway_pool.retire(transport)
             continue
 
-        # read framed response; first attempt 30s, retry 40s
-        resp_body = _read_gateway_response(timeout=30.0 if attempt == 0 else 40.0)
-        if not resp_body:
-            if attempt == 0:
-                print("⚠️ No response received from MCP gateway. Restarting gateway and retrying...")
-                try:
-                    gateway_proc.kill()
-                except Exception:
-                    pass
-                start_gateway(load_gateway_cmd_from_config())
-                # quick diagnostic read (give gateway slightly more time)
-                try:
-                    diag = _read_gateway_response(timeout=2.0)
-                    if diag:
-                        print("🔴 Gateway response during restart (debug):", diag.strip())
-                except Exception:
-                    pass
-                continue
-            else:
-                print("❗ No response received from MCP gateway after restart attempts. Proceeding without tool result.")
-                return None
+        try:
+            resp = fut.result(timeout=CALL_TIMEOUT)
+        except FutureTimeout:
+            metrics.incr("mcp_timeouts")
+            transport.forget(req["id"])
+            # a slow tool is not a dead gateway; resending it elsewhere would double
+            # its side effects, so only retire the worker if it stops answering pings
+            gateway_pool.check_async(transport)
+            print(f"❗ No response to {req['method']} within {CALL_TIMEOUT:.0f}s. Proceeding without tool result.")
+            return None
+        except ConnectionError as e:
+            # the worker died with the call in flight, possibly because of it;
+            # resending could crash another worker or repeat half-done side effects
+            metrics.incr("mcp_disconnects")
+            gateway_pool.retire(transport)
+            print(f"❗ MCP gateway closed before answering {req['method']} ({e}). Proceeding without tool result.")
+            return None
+        except Exception as e:
+            # the reply arrived but parse() could not make sense of it
+            metrics.incr("mcp_bad_replies")
+            print(f"❗ Malformed MCP reply to {req['method']} ({e!r}). Proceeding without tool result.")
+            return None
 
-        # parse JSON-RPC response string
-        resp = parse(resp_body)
         return resp.result if hasattr(resp, "result") else resp.data
+    print("❗ Could not send request to any MCP gateway. Proceeding without tool result.")
+    return None
 
 if __name__ == "__main__":
     main()